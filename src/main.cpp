@@ -1,6 +1,13 @@
 #include <Geode/Geode.hpp>
 
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <thread>
 
 #include <ctre.hpp>
 
@@ -171,8 +178,433 @@ struct Shader {
     }
 };
 
+// traces store everything that goes into a shader each frame, so performance issues can be reproduced
+// without the user's music, mouse and menu layout.
+// values are stored as xor deltas against the previous frame encoded as varints,
+// so anything that doesn't change between frames (static nodes, time's exponent, etc.) only takes up a byte or two.
+// xor barely helps with the spectrum since pretty much every bin changes on every update,
+// so it's quantized to 16 bits and stored as the difference from the previous one instead,
+// and only when fmod gives us a new one, since the frames in between are interpolated anyway
+struct TraceFormat {
+    static constexpr uint32_t MAGIC = 0x5254534d; // MSTR
+    static constexpr uint32_t VERSION = 2;
+    static constexpr uint8_t FLAG_NEW_SPECTRUM = 1 << 0;
+    static constexpr uint8_t FLAG_OLD_SPECTRUM = 1 << 1;
+    static constexpr float SPECTRUM_SCALE = 65535.f;
+
+    static int32_t quantize(float value) {
+        return (int32_t)std::lround(std::clamp(value, 0.f, 1.f) * SPECTRUM_SCALE);
+    }
+    static float dequantize(int32_t value) {
+        return (float)value / SPECTRUM_SCALE;
+    }
+};
+
+class TraceWriter {
+    std::ofstream m_stream;
+    std::vector<uint32_t> m_values;
+    std::vector<int32_t> m_spectrum;
+
+    template <typename T>
+    void writeRaw(T value) {
+        m_stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void writeVarint(uint32_t value) {
+        while (value >= 0x80) {
+            m_stream.put(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        m_stream.put(static_cast<char>(value));
+    }
+
+    void writeDeltas(const float* values, const std::vector<uint32_t>& previous) {
+        for (size_t i = 0; i < previous.size(); ++i)
+            writeVarint(std::bit_cast<uint32_t>(values[i]) ^ previous[i]);
+    }
+
+    static void store(const float* values, std::vector<uint32_t>& previous) {
+        for (size_t i = 0; i < previous.size(); ++i)
+            previous[i] = std::bit_cast<uint32_t>(values[i]);
+    }
+
+    void writeSpectrumDeltas(const float* spectrum, const std::vector<int32_t>& previous) {
+        for (size_t i = 0; i < previous.size(); ++i) {
+            auto delta = TraceFormat::quantize(spectrum[i]) - previous[i];
+            // zigzag so small negative deltas stay small
+            writeVarint((static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31));
+        }
+    }
+
+public:
+    Result<> open(const std::filesystem::path& path, const std::string& menuName, uint64_t shaderHash,
+        size_t valueCount, size_t spectrumSize) {
+        m_stream.open(path, std::ios::binary | std::ios::trunc);
+        if (!m_stream)
+            return Err("failed to open {}", path.string());
+        m_values.assign(valueCount, 0);
+        m_spectrum.assign(spectrumSize, 0);
+        writeRaw(TraceFormat::MAGIC);
+        writeRaw(TraceFormat::VERSION);
+        writeRaw(static_cast<uint32_t>(menuName.size()));
+        m_stream.write(menuName.data(), (std::streamsize)menuName.size());
+        writeRaw(shaderHash);
+        writeRaw(static_cast<uint32_t>(valueCount));
+        writeRaw(static_cast<uint32_t>(spectrumSize));
+        return Ok();
+    }
+
+    // the spectrums should only be passed on frames where they were updated
+    void writeFrame(const float* values, const float* oldSpectrum, const float* newSpectrum) {
+        uint8_t flags = 0;
+        if (newSpectrum) {
+            flags |= TraceFormat::FLAG_NEW_SPECTRUM;
+            for (size_t i = 0; i < m_spectrum.size(); ++i) {
+                if (TraceFormat::quantize(oldSpectrum[i]) != m_spectrum[i]) {
+                    flags |= TraceFormat::FLAG_OLD_SPECTRUM;
+                    break;
+                }
+            }
+        }
+        writeRaw(flags);
+        writeDeltas(values, m_values);
+        store(values, m_values);
+        if (flags & TraceFormat::FLAG_OLD_SPECTRUM)
+            writeSpectrumDeltas(oldSpectrum, m_spectrum);
+        if (flags & TraceFormat::FLAG_NEW_SPECTRUM) {
+            writeSpectrumDeltas(newSpectrum, m_spectrum);
+            for (size_t i = 0; i < m_spectrum.size(); ++i)
+                m_spectrum[i] = TraceFormat::quantize(newSpectrum[i]);
+        }
+    }
+};
+
+class TraceReader {
+    ByteVector m_data;
+    size_t m_position = 0;
+    std::string m_menuName;
+    uint64_t m_shaderHash = 0;
+    std::vector<uint32_t> m_valueBits;
+    std::vector<int32_t> m_spectrumLevels;
+    std::vector<float> m_values;
+    std::vector<float> m_oldSpectrum;
+    std::vector<float> m_newSpectrum;
+
+    template <typename T>
+    bool readRaw(T& value) {
+        if (m_position + sizeof(T) > m_data.size())
+            return false;
+        std::memcpy(&value, m_data.data() + m_position, sizeof(T));
+        m_position += sizeof(T);
+        return true;
+    }
+
+    bool readVarint(uint32_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            if (m_position >= m_data.size())
+                return false;
+            auto byte = m_data[m_position++];
+            value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    bool readDeltas(const std::vector<uint32_t>& previous, std::vector<float>& values) {
+        for (size_t i = 0; i < previous.size(); ++i) {
+            uint32_t delta;
+            if (!readVarint(delta))
+                return false;
+            values[i] = std::bit_cast<float>(previous[i] ^ delta);
+        }
+        return true;
+    }
+
+    static void store(const std::vector<float>& values, std::vector<uint32_t>& previous) {
+        for (size_t i = 0; i < previous.size(); ++i)
+            previous[i] = std::bit_cast<uint32_t>(values[i]);
+    }
+
+    bool readSpectrumDeltas(std::vector<int32_t>& levels) {
+        for (size_t i = 0; i < m_spectrumLevels.size(); ++i) {
+            uint32_t zigzag;
+            if (!readVarint(zigzag))
+                return false;
+            auto delta = static_cast<int32_t>(zigzag >> 1) ^ -static_cast<int32_t>(zigzag & 1);
+            levels[i] = m_spectrumLevels[i] + delta;
+        }
+        return true;
+    }
+
+public:
+    Result<> open(const std::filesystem::path& path) {
+        auto data = file::readBinary(path);
+        if (!data)
+            return Err("failed to read {}: {}", path.string(), data.unwrapErr());
+        m_data = std::move(data.unwrap());
+        m_position = 0;
+
+        uint32_t magic, version, nameSize, valueCount, spectrumSize;
+        if (!readRaw(magic) || magic != TraceFormat::MAGIC)
+            return Err("{} is not a trace", path.string());
+        if (!readRaw(version) || version != TraceFormat::VERSION)
+            return Err("{} has an unsupported trace version", path.string());
+        if (!readRaw(nameSize) || m_position + nameSize > m_data.size())
+            return Err("{} is truncated", path.string());
+        m_menuName.assign(reinterpret_cast<const char*>(m_data.data() + m_position), nameSize);
+        m_position += nameSize;
+        if (!readRaw(m_shaderHash) || !readRaw(valueCount) || !readRaw(spectrumSize))
+            return Err("{} is truncated", path.string());
+
+        m_valueBits.assign(valueCount, 0);
+        m_values.assign(valueCount, 0.f);
+        m_spectrumLevels.assign(spectrumSize, 0);
+        m_oldSpectrum.assign(spectrumSize, 0.f);
+        m_newSpectrum.assign(spectrumSize, 0.f);
+        return Ok();
+    }
+
+    // returns false once there are no more frames or the trace is truncated
+    bool nextFrame() {
+        uint8_t flags;
+        if (!readRaw(flags))
+            return false;
+        if (!readDeltas(m_valueBits, m_values))
+            return false;
+        store(m_values, m_valueBits);
+        if (flags & TraceFormat::FLAG_NEW_SPECTRUM) {
+            std::vector<int32_t> levels(m_spectrumLevels.size());
+            if (flags & TraceFormat::FLAG_OLD_SPECTRUM) {
+                if (!readSpectrumDeltas(levels))
+                    return false;
+                for (size_t i = 0; i < levels.size(); ++i)
+                    m_oldSpectrum[i] = TraceFormat::dequantize(levels[i]);
+            }
+            else {
+                m_oldSpectrum = m_newSpectrum;
+            }
+            if (!readSpectrumDeltas(levels))
+                return false;
+            m_spectrumLevels = levels;
+            for (size_t i = 0; i < levels.size(); ++i)
+                m_newSpectrum[i] = TraceFormat::dequantize(levels[i]);
+        }
+        return true;
+    }
+
+    bool atEnd() const { return m_position >= m_data.size(); }
+    const std::string& menuName() const { return m_menuName; }
+    uint64_t shaderHash() const { return m_shaderHash; }
+    size_t spectrumSize() const { return m_newSpectrum.size(); }
+    const std::vector<float>& values() const { return m_values; }
+    const std::vector<float>& oldSpectrum() const { return m_oldSpectrum; }
+    const std::vector<float>& newSpectrum() const { return m_newSpectrum; }
+};
+
+// lookup tables declared with //!lut, so shaders can fetch noise and such instead of computing it per pixel.
+// they're generated on worker threads when the shader is loaded and cached in the save dir
+struct LookupTable {
+    // bump whenever the generators change to invalidate old caches
+    static constexpr int VERSION = 1;
+
+    std::string type;
+    uint32_t width = 1;
+    uint32_t height = 1;
+    std::vector<std::string> args;
+    ccTexParams params { GL_LINEAR, GL_LINEAR, GL_REPEAT, GL_REPEAT };
+    // resolved on the main thread since it needs the mod's save dir
+    std::filesystem::path cachePath;
+    ByteVector pixels;
+
+    static Result<LookupTable> parse(const std::string& directive) {
+        LookupTable lut;
+        std::istringstream stream(directive);
+        std::string size;
+        stream >> lut.type >> size;
+        for (std::string arg; stream >> arg;)
+            lut.args.push_back(arg);
+
+        auto sizeRes = utils::numFromString<uint32_t>(size);
+        if (!sizeRes)
+            return Err("invalid //!lut size '{}'", size);
+        // repeating textures need power of 2 sizes on mobile
+        lut.width = std::bit_ceil(std::clamp(sizeRes.unwrap(), 2u, 1024u));
+
+        if (lut.type == "noise2d") {
+            lut.height = lut.width;
+        }
+        else if (lut.type == "blue-noise") {
+            // you don't really need bigger ones since they tile well
+            lut.width = std::min(lut.width, 256u);
+            lut.height = lut.width;
+            lut.params = { GL_NEAREST, GL_NEAREST, GL_REPEAT, GL_REPEAT };
+        }
+        else if (lut.type == "gradient") {
+            if (lut.args.empty())
+                return Err("//!lut gradient needs at least one color");
+            lut.height = 1;
+            lut.params = { GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE };
+        }
+        else {
+            return Err("unknown //!lut type '{}'", lut.type);
+        }
+
+        std::string key = lut.type;
+        for (auto& arg : lut.args)
+            key += " " + arg;
+        lut.cachePath = Mod::get()->getSaveDir() / "luts" /
+            fmt::format("{}-{}x{}-{:x}-v{}.rgba", lut.type, lut.width, lut.height, std::hash<std::string>{}(key), VERSION);
+        return Ok(lut);
+    }
+
+    Result<> load() {
+        auto size = (size_t)width * height * 4;
+        auto& path = cachePath;
+        if (auto cached = file::readBinary(path); cached && cached.unwrap().size() == size) {
+            pixels = std::move(cached.unwrap());
+            return Ok();
+        }
+
+        pixels.resize(size);
+        if (type == "noise2d")
+            generateNoise();
+        else if (type == "blue-noise")
+            generateBlueNoise();
+        else if (auto res = generateGradient(); !res)
+            return res;
+
+        std::error_code err;
+        std::filesystem::create_directories(path.parent_path(), err);
+        if (auto res = file::writeBinary(path, pixels); !res)
+            log::warn("failed to cache lookup table to {}: {}", path.string(), res.unwrapErr());
+        return Ok();
+    }
+
+private:
+    static uint32_t hash(uint32_t x) {
+        // lowbias32
+        x ^= x >> 16;
+        x *= 0x7feb352d;
+        x ^= x >> 15;
+        x *= 0x846ca68b;
+        x ^= x >> 16;
+        return x;
+    }
+
+    static void parallelFor(size_t count, const std::function<void(size_t)>& func) {
+        auto threadCount = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, count);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < threadCount; ++t) {
+            threads.emplace_back([&, t] {
+                for (size_t i = t; i < count; i += threadCount)
+                    func(i);
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    // independent white noise in every channel
+    void generateNoise() {
+        parallelFor(height, [&](size_t y) {
+            for (size_t x = 0; x < width; ++x) {
+                auto seed = hash((uint32_t)(y * width + x));
+                for (size_t c = 0; c < 4; ++c)
+                    pixels[(y * width + x) * 4 + c] = (uint8_t)(hash(seed + (uint32_t)c) >> 24);
+            }
+        });
+    }
+
+    // the ranking phase of void and cluster, starting from an empty pattern
+    // and always filling the biggest void next, which is where the energy is the lowest
+    void generateBlueNoise() {
+        constexpr float SIGMA = 1.5f;
+        constexpr int RADIUS = 5;
+        float kernel[RADIUS * 2 + 1][RADIUS * 2 + 1];
+        for (int y = -RADIUS; y <= RADIUS; ++y) {
+            for (int x = -RADIUS; x <= RADIUS; ++x)
+                kernel[y + RADIUS][x + RADIUS] = std::exp(-(float)(x * x + y * y) / (2.f * SIGMA * SIGMA));
+        }
+
+        auto count = (size_t)width * height;
+        std::vector<float> energy(count);
+        // tiny bit of noise to break ties, otherwise it'd just fill the texture in order
+        for (size_t i = 0; i < count; ++i)
+            energy[i] = (float)hash((uint32_t)i) / (float)UINT32_MAX * 1e-3f;
+
+        // tournament tree of the lowest energy pixel, so finding the biggest void doesn't need a full scan.
+        // the size is always a power of 2, so this is a perfect binary tree with the pixels as leaves
+        std::vector<uint32_t> tree(count * 2);
+        const auto lower = [&](uint32_t a, uint32_t b) { return energy[a] <= energy[b] ? a : b; };
+        for (size_t i = 0; i < count; ++i)
+            tree[count + i] = (uint32_t)i;
+        for (size_t node = count - 1; node > 0; --node)
+            tree[node] = lower(tree[node * 2], tree[node * 2 + 1]);
+        const auto bubble = [&](size_t i) {
+            for (auto node = (count + i) / 2; node > 0; node /= 2)
+                tree[node] = lower(tree[node * 2], tree[node * 2 + 1]);
+        };
+
+        for (size_t rank = 0; rank < count; ++rank) {
+            size_t best = tree[1];
+            // filled pixels can't be picked again
+            energy[best] = std::numeric_limits<float>::infinity();
+            bubble(best);
+            auto value = (uint8_t)(rank * 256 / count);
+            std::fill_n(&pixels[best * 4], 3, value);
+            pixels[best * 4 + 3] = 255;
+
+            int bestX = (int)(best % width);
+            int bestY = (int)(best / width);
+            for (int y = -RADIUS; y <= RADIUS; ++y) {
+                auto row = ((bestY + y) % (int)height + (int)height) % (int)height;
+                for (int x = -RADIUS; x <= RADIUS; ++x) {
+                    auto column = ((bestX + x) % (int)width + (int)width) % (int)width;
+                    auto i = row * width + column;
+                    if (std::isinf(energy[i]))
+                        continue;
+                    energy[i] += kernel[y + RADIUS][x + RADIUS];
+                    bubble(i);
+                }
+            }
+        }
+    }
+
+    // colors spread evenly across the texture
+    Result<> generateGradient() {
+        std::vector<ccColor4B> colors;
+        for (auto& arg : args) {
+            auto color = cc4bFromHexString(arg, false, true);
+            if (!color)
+                return Err("invalid //!lut gradient color '{}'", arg);
+            colors.push_back(color.unwrap());
+        }
+        for (size_t x = 0; x < width; ++x) {
+            auto position = colors.size() == 1 ? 0.f : (float)x / (float)(width - 1) * (float)(colors.size() - 1);
+            auto index = std::min((size_t)position, colors.size() - 1);
+            auto next = std::min(index + 1, colors.size() - 1);
+            auto t = position - (float)index;
+            auto& a = colors[index];
+            auto& b = colors[next];
+            pixels[x * 4 + 0] = (uint8_t)std::lround(a.r + (b.r - a.r) * t);
+            pixels[x * 4 + 1] = (uint8_t)std::lround(a.g + (b.g - a.g) * t);
+            pixels[x * 4 + 2] = (uint8_t)std::lround(a.b + (b.b - a.b) * t);
+            pixels[x * 4 + 3] = (uint8_t)std::lround(a.a + (b.a - a.a) * t);
+        }
+        return Ok();
+    }
+};
+
 float s_shaderTime = 0.f;
 GLint s_shaderFrame = 0;
+// amount of bins we use out of an fft window of this size, see FFT_ACTUAL_SPECTRUM_SIZE for why.
+// not a member so it can be used in static_assert inside the class
+constexpr int getActualSpectrumSize(int windowSize) {
+    auto spectrumSize = windowSize / 2;
+    return spectrumSize - (spectrumSize * 140 / 512);
+}
 class ShaderNode : public CCNode {
     Shader m_shader;
     GLuint m_vao = 0;
@@ -190,6 +622,20 @@ class ShaderNode : public CCNode {
     GLint m_uniformPulse3 = 0;
     GLint m_uniformFft = 0;
     std::vector<std::tuple<std::string, CCNode*, GLint, GLint, GLint, GLint, GLint>> m_uniformNodes;
+    // nodes that are looked up by id again whenever they're gone, since they can be created later or replaced
+    struct TrackedNode {
+        std::string id;
+        WeakRef<CCNode> node = static_cast<CCNode*>(nullptr);
+        // only warn once until the node shows up again
+        bool warned = false;
+    };
+    // 2 vec4s per node: (pos.x, pos.y, size.x, size.y), (rot, scale.x, scale.y, visible)
+    static constexpr size_t NODE_DATA_SIZE = 8;
+    std::vector<TrackedNode> m_packedNodes;
+    // //# nodes first, then //!nodes ones, so the latter can be uploaded in one go
+    std::vector<float> m_nodeData;
+    GLint m_uniformPackedNodes = 0;
+    GLint m_uniformNodeCount = 0;
     float m_deltaTime = 0.f;
     float m_time = 0.f;
     GLint m_frame = 0;
@@ -203,21 +649,95 @@ class ShaderNode : public CCNode {
     static constexpr int FFT_ACTUAL_SPECTRUM_SIZE = FFT_SPECTRUM_SIZE - (FFT_SPECTRUM_SIZE * 140 / 512);
     static constexpr int FFT_WINDOW_SIZE = FFT_SPECTRUM_SIZE * 2;
     static constexpr float FFT_UPDATE_FREQUENCY = 20.f;
-    float m_spectrum[FFT_ACTUAL_SPECTRUM_SIZE] { };
-    float m_oldSpectrum[FFT_ACTUAL_SPECTRUM_SIZE] { };
-    float m_newSpectrum[FFT_ACTUAL_SPECTRUM_SIZE] { };
+    // fmod's limits
+    static constexpr int FFT_MIN_WINDOW_SIZE = 128;
+    static constexpr int FFT_MAX_WINDOW_SIZE = 16384;
+    static_assert(getActualSpectrumSize(FFT_WINDOW_SIZE) == FFT_ACTUAL_SPECTRUM_SIZE);
+
+    // everything below can be changed by shaders with //!fft, defaults are what we've always used
+    enum class SpectrumScale { Linear, Log, Mel };
+    size_t m_spectrumBins = 0; // all of them
+    SpectrumScale m_spectrumScale = SpectrumScale::Linear;
+    int m_fftWindowType = FMOD_DSP_FFT_WINDOW_HAMMING;
+    int m_fftWindowSize = 0; // picked based on the bins
+    float m_spectrumRate = FFT_UPDATE_FREQUENCY;
+    float m_spectrumSmoothing = 0.f;
+    // [start, end) ranges of fmod's bins averaged into each of ours
+    std::vector<std::pair<size_t, size_t>> m_spectrumBands;
+    std::vector<float> m_rawSpectrum;
+    std::vector<float> m_spectrum;
+    std::vector<float> m_oldSpectrum;
+    std::vector<float> m_newSpectrum;
     float m_spectrumUpdateAccumulator = 0.f;
+    float m_spectrumBlend = 0.f;
+    bool m_spectrumUpdated = false;
     CCArrayExt<CCSprite*> m_shaderSprites;
+    // shared with the worker generating it, so it's fine for the node to go away before it's done
+    struct PendingLookupTable {
+        LookupTable lut;
+        std::optional<std::string> error;
+        std::atomic<bool> done = false;
+    };
+    std::vector<std::shared_ptr<PendingLookupTable>> m_lookupTables;
+    // placeholders until the lookup tables are generated
+    CCArrayExt<CCTexture2D*> m_lookupTextures;
+
+    // baked loops are kept around between menu visits so we only have to pay for them once,
+    // but only the latest one for each menu, so resizing the window or editing the shader doesn't pile them up
+    struct BakedLoop {
+        size_t fragmentHash = 0;
+        float width = 0.f;
+        float height = 0.f;
+        size_t frameCount = 0;
+        float period = 0.f;
+        std::vector<Ref<CCRenderTexture>> frames;
+        size_t baked = 0;
+    };
+    static inline std::unordered_map<std::string, std::shared_ptr<BakedLoop>> s_bakedLoops;
+    static inline Shader s_loopPlaybackShader;
+    static constexpr size_t LOOP_BAKE_FRAMES_PER_DRAW = 2;
+    static constexpr size_t LOOP_MAX_FRAMES = 240;
+    std::string m_menuName;
+    float m_loopPeriod = 0.f;
+    size_t m_loopFrames = 60;
+    float m_loopScale = 0.25f;
+    size_t m_fragmentHash = 0;
+    std::shared_ptr<BakedLoop> m_bakedLoop;
+    GLint m_uniformLoopResolution = 0;
+    GLint m_uniformLoopUvScale = 0;
+    GLint m_uniformLoopBlend = 0;
+
+    // everything the shader gets each frame besides sprites, so it can be captured and replayed
+    struct FrameInputs {
+        CCSize resolution;
+        float time = 0.f;
+        float deltaTime = 0.f;
+        GLint frame = 0;
+        CCPoint mouse;
+        float pulse1 = 0.f;
+        float pulse2 = 0.f;
+        float pulse3 = 0.f;
+        float spectrumBlend = 0.f;
+        const float* spectrum = nullptr;
+        const float* nodes = nullptr;
+    };
+    // resolution, time, delta time, frame, mouse, pulses and spectrum blend, followed by node data
+    static constexpr size_t TRACE_FIXED_VALUES = 11;
+    std::unique_ptr<TraceWriter> m_traceWriter;
+    std::vector<float> m_traceValues;
+    std::filesystem::path m_replayPath;
+
+    // opaque nodes covering the shader, pixels under them are skipped by drawing the quad around them
+    // layers like LevelBrowserLayer recreate these, so they're only held weakly and looked up again when they're gone
+    std::vector<std::pair<std::string, WeakRef<CCNode>>> m_occluders;
+    std::vector<std::array<float, 4>> m_occluderRects;
+    GLuint m_occludedVao = 0;
+    GLuint m_occludedVbo = 0;
+    GLsizei m_occludedVertexCount = 0;
+    // most opaque backgrounds are 9-slices with rounded corners, so we can't cull right up to their edges
+    static constexpr float OCCLUDER_INSET = 10.f;
 
 public:
-    ShaderNode() {
-        for (int i = 0; i < FFT_ACTUAL_SPECTRUM_SIZE; ++i) {
-            m_spectrum[i] = 0.f;
-            m_oldSpectrum[i] = 0.f;
-            m_newSpectrum[i] = 0.f;
-        }
-    }
-
     bool init(const std::string& vert, const std::string& frag) {
         this->setID("shader-background");
 
@@ -278,15 +798,109 @@ public:
                 if (!line.empty())
                     addNode(line);
             }
+            if (line.starts_with("//!nodes")) {
+                line = utils::string::trim(line.substr(8));
+                const auto addNode = [&](const std::string& id) {
+                    m_packedNodes.push_back({ .id = id });
+                };
+                std::string::size_type pos;
+                while (pos = line.find(','), pos != std::string::npos) {
+                    auto me = line.substr(0, pos);
+                    line = line.substr(pos + 1);
+                    addNode(me);
+                }
+                if (!line.empty())
+                    addNode(line);
+            }
+            if (line.starts_with("//!loop")) {
+                std::istringstream args(line.substr(7));
+                std::string period, frames, scale;
+                args >> period >> frames >> scale;
+                m_loopPeriod = utils::numFromString<float>(period).unwrapOr(0.f);
+                m_loopFrames = std::min(utils::numFromString<size_t>(frames).unwrapOr(m_loopFrames), LOOP_MAX_FRAMES);
+                m_loopScale = std::clamp(utils::numFromString<float>(scale).unwrapOr(m_loopScale), 0.05f, 1.f);
+                if (m_loopPeriod <= 0.f || m_loopFrames < 2) {
+                    log::warn("For shader developers: invalid //!loop directive, expected a positive period and at least 2 frames");
+                    m_loopPeriod = 0.f;
+                }
+            }
+            if (line.starts_with("//!fft")) {
+                std::istringstream args(line.substr(6));
+                for (std::string arg; args >> arg;) {
+                    auto pos = arg.find('=');
+                    auto key = arg.substr(0, pos);
+                    auto value = pos == std::string::npos ? "" : arg.substr(pos + 1);
+                    if (key == "bins") {
+                        m_spectrumBins = std::clamp<size_t>(utils::numFromString<size_t>(value).unwrapOr(0), 0,
+                            getActualSpectrumSize(FFT_MAX_WINDOW_SIZE));
+                    }
+                    else if (key == "scale" && value == "linear") {
+                        m_spectrumScale = SpectrumScale::Linear;
+                    }
+                    else if (key == "scale" && value == "log") {
+                        m_spectrumScale = SpectrumScale::Log;
+                    }
+                    else if (key == "scale" && value == "mel") {
+                        m_spectrumScale = SpectrumScale::Mel;
+                    }
+                    else if (key == "window" && value == "rect") {
+                        m_fftWindowType = FMOD_DSP_FFT_WINDOW_RECT;
+                    }
+                    else if (key == "window" && value == "triangle") {
+                        m_fftWindowType = FMOD_DSP_FFT_WINDOW_TRIANGLE;
+                    }
+                    else if (key == "window" && value == "hamming") {
+                        m_fftWindowType = FMOD_DSP_FFT_WINDOW_HAMMING;
+                    }
+                    else if (key == "window" && value == "hann") {
+                        m_fftWindowType = FMOD_DSP_FFT_WINDOW_HANNING;
+                    }
+                    else if (key == "window" && value == "blackman") {
+                        m_fftWindowType = FMOD_DSP_FFT_WINDOW_BLACKMAN;
+                    }
+                    else if (key == "window" && value == "blackman-harris") {
+                        m_fftWindowType = FMOD_DSP_FFT_WINDOW_BLACKMANHARRIS;
+                    }
+                    else if (key == "size") {
+                        auto size = utils::numFromString<int>(value).unwrapOr(0);
+                        m_fftWindowSize = size <= 0 ? 0 :
+                            std::clamp((int)std::bit_ceil((unsigned)size), FFT_MIN_WINDOW_SIZE, FFT_MAX_WINDOW_SIZE);
+                    }
+                    else if (key == "rate") {
+                        m_spectrumRate = std::clamp(utils::numFromString<float>(value).unwrapOr(FFT_UPDATE_FREQUENCY), 1.f, 240.f);
+                    }
+                    else if (key == "smoothing") {
+                        m_spectrumSmoothing = std::clamp(utils::numFromString<float>(value).unwrapOr(0.f), 0.f, 0.99f);
+                    }
+                    else {
+                        log::warn("For shader developers: unknown //!fft option '{}'", arg);
+                    }
+                }
+            }
+            if (line.starts_with("//!lut")) {
+                auto lut = LookupTable::parse(line.substr(6));
+                if (lut)
+                    m_lookupTables.push_back(std::make_shared<PendingLookupTable>(std::move(lut.unwrap())));
+                else
+                    log::warn("For shader developers: {}", lut.unwrapErr());
+            }
         }
+        loadLookupTables();
+        m_fragmentHash = std::hash<std::string>{}(frag);
+
+        if (m_loopPeriod > 0.f && !initLoopPlayback())
+            m_loopPeriod = 0.f;
 
         FMODAudioEngine::sharedEngine()->enableMetering();
 
         auto engine = FMODAudioEngine::sharedEngine();
+        int sampleRate = 0;
+        engine->m_system->getSoftwareFormat(&sampleRate, nullptr, nullptr);
+        configureSpectrum(sampleRate > 0 ? (float)sampleRate : 44100.f);
         engine->m_system->createDSPByType(FMOD_DSP_TYPE_FFT, &m_fftDsp);
         engine->m_backgroundMusicChannel->addDSP(1, m_fftDsp);
-        m_fftDsp->setParameterInt(FMOD_DSP_FFT_WINDOWTYPE, FMOD_DSP_FFT_WINDOW_HAMMING);
-        m_fftDsp->setParameterInt(FMOD_DSP_FFT_WINDOWSIZE, FFT_WINDOW_SIZE);
+        m_fftDsp->setParameterInt(FMOD_DSP_FFT_WINDOWTYPE, m_fftWindowType);
+        m_fftDsp->setParameterInt(FMOD_DSP_FFT_WINDOWSIZE, m_fftWindowSize);
         m_fftDsp->setActive(true);
 
         GLfloat vertices[] = {
@@ -336,16 +950,90 @@ public:
         m_uniformPulse3 = glGetUniformLocation(m_shader.program, "pulse3");
         m_uniformFft = glGetUniformLocation(m_shader.program, "fft");
 
+        m_uniformPackedNodes = glGetUniformLocation(m_shader.program, "nodes");
+        m_uniformNodeCount = glGetUniformLocation(m_shader.program, "nodeCount");
+        m_nodeData.resize((m_uniformNodes.size() + m_packedNodes.size()) * NODE_DATA_SIZE);
+
+        if (m_uniformPackedNodes != -1) {
+            GLint maxVectors = 0;
+#ifdef GL_MAX_FRAGMENT_UNIFORM_VECTORS
+            glGetIntegerv(GL_MAX_FRAGMENT_UNIFORM_VECTORS, &maxVectors);
+#else
+            glGetIntegerv(GL_MAX_FRAGMENT_UNIFORM_COMPONENTS, &maxVectors);
+            maxVectors /= 4;
+#endif
+            auto vectors = m_packedNodes.size() * NODE_DATA_SIZE / 4;
+            // fft is the other big one, 4 bins fit in a vec4
+            auto fftVectors = m_uniformFft == -1 ? 0 : (m_newSpectrum.size() + 3) / 4;
+            if (maxVectors > 0 && vectors + fftVectors > (size_t)maxVectors) {
+                log::warn("For shader developers: {} nodes need {} uniform vectors ({} with fft), but this GPU only has {} for fragment shaders",
+                    m_packedNodes.size(), vectors, vectors + fftVectors, maxVectors);
+            }
+        }
+
         for (size_t i = 0; i < m_shaderSprites.size(); ++i) {
             auto uniform = glGetUniformLocation(m_shader.program, ("sprite" + std::to_string(i)).c_str());
             glUniform1i(uniform, (GLint)i);
         }
+        for (size_t i = 0; i < m_lookupTextures.size(); ++i) {
+            auto uniform = glGetUniformLocation(m_shader.program, ("lut" + std::to_string(i)).c_str());
+            glUniform1i(uniform, (GLint)(m_shaderSprites.size() + i));
+        }
 
         this->scheduleUpdate();
         return true;
     }
 
+    static CCTexture2D* createLookupTexture(const void* pixels, uint32_t width, uint32_t height, ccTexParams params) {
+        auto texture = new CCTexture2D();
+        texture->initWithData(pixels, kCCTexture2DPixelFormat_RGBA8888,
+            width, height, CCSize((float)width, (float)height));
+        texture->setTexParameters(&params);
+        texture->autorelease();
+        return texture;
+    }
+
+    void loadLookupTables() {
+        for (auto& pending : m_lookupTables) {
+            const uint8_t placeholder[4] { 0, 0, 0, 0 };
+            m_lookupTextures.push_back(createLookupTexture(placeholder, 1, 1, pending->lut.params));
+            std::thread([pending] {
+                if (auto res = pending->lut.load(); !res)
+                    pending->error = res.unwrapErr();
+                pending->done = true;
+            }).detach();
+        }
+    }
+
+    // uploads the lookup tables that finished generating since the last frame
+    void updateLookupTables() {
+        for (size_t i = 0; i < m_lookupTables.size(); ++i) {
+            auto& pending = m_lookupTables[i];
+            if (!pending || !pending->done)
+                continue;
+            auto& lut = pending->lut;
+            if (pending->error) {
+                // the placeholder stays so the indices of the rest are intact
+                log::error("failed to generate lookup table {}: {}", i, *pending->error);
+            }
+            else {
+                auto texture = createLookupTexture(lut.pixels.data(), lut.width, lut.height, lut.params);
+                m_lookupTextures.inner()->replaceObjectAtIndex(i, texture);
+            }
+            // no need to keep the pixels around after they're uploaded
+            pending = nullptr;
+        }
+    }
+
+    bool lookupTablesReady() const {
+        return std::all_of(m_lookupTables.begin(), m_lookupTables.end(), [](auto& pending) { return !pending; });
+    }
+
     ~ShaderNode() override {
+        if (m_occludedVao)
+            glDeleteVertexArrays(1, &m_occludedVao);
+        if (m_occludedVbo)
+            glDeleteBuffers(1, &m_occludedVbo);
         if (m_fftDsp) {
             FMODAudioEngine::sharedEngine()->m_backgroundMusicChannel->removeDSP(m_fftDsp);
         }
@@ -363,29 +1051,116 @@ public:
         s_shaderTime = m_time;
         s_shaderFrame = m_frame;
 
-        const float speed = 1.f / FFT_UPDATE_FREQUENCY;
+        const float speed = 1.f / m_spectrumRate;
         if (m_spectrumUpdateAccumulator >= speed) {
             if (m_fftDsp) {
                 FMOD_DSP_PARAMETER_FFT* data;
                 unsigned int length;
                 m_fftDsp->getParameterData(FMOD_DSP_FFT_SPECTRUMDATA, (void**)&data, &length, nullptr, 0);
                 if (length) {
-                    for (size_t i = 0; i < std::min(data->length, FFT_ACTUAL_SPECTRUM_SIZE); i++) {
-                        m_oldSpectrum[i] = m_newSpectrum[i];
-                        m_newSpectrum[i] = 0.f;
-                        int n = std::min(data->numchannels, 2);
-                        for (size_t j = 0; j < n; ++j) {
-                            m_newSpectrum[i] += data->spectrum[j][i];
+                    m_spectrumUpdated = true;
+                    auto size = std::min((size_t)std::max(data->length, 0), m_rawSpectrum.size());
+                    int n = std::min(data->numchannels, 2);
+                    std::fill(m_rawSpectrum.begin(), m_rawSpectrum.end(), 0.f);
+                    for (size_t j = 0; j < n; ++j) {
+                        auto channel = data->spectrum[j];
+                        for (size_t i = 0; i < size; i++) {
+                            m_rawSpectrum[i] += channel[i];
                         }
-                        m_newSpectrum[i] /= float(n);
                     }
+                    for (size_t i = 0; i < size; i++) {
+                        m_rawSpectrum[i] /= float(n);
+                    }
+                    m_oldSpectrum = m_newSpectrum;
+                    reduceSpectrum();
                 }
             }
             m_spectrumUpdateAccumulator = 0.f;
         }
-        float t = m_spectrumUpdateAccumulator * FFT_UPDATE_FREQUENCY;
-        for (int i = 0; i < FFT_ACTUAL_SPECTRUM_SIZE; i++) {
-            m_spectrum[i] = (1.f - t) * m_oldSpectrum[i] + t * m_newSpectrum[i];
+        m_spectrumBlend = m_spectrumUpdateAccumulator * m_spectrumRate;
+        blendSpectrum(m_spectrum.data(), m_oldSpectrum.data(), m_newSpectrum.data(), m_spectrum.size(), m_spectrumBlend);
+    }
+
+    void configureSpectrum(float sampleRate) {
+        if (m_fftWindowSize == 0) {
+            m_fftWindowSize = FFT_WINDOW_SIZE;
+            // linear spectrums don't need any more resolution than the amount of bins,
+            // log and mel ones need as much as they can get for the low frequencies
+            if (m_spectrumBins != 0 && m_spectrumScale == SpectrumScale::Linear) {
+                m_fftWindowSize = FFT_MIN_WINDOW_SIZE;
+                while (getActualSpectrumSize(m_fftWindowSize) < (int)m_spectrumBins && m_fftWindowSize < FFT_MAX_WINDOW_SIZE)
+                    m_fftWindowSize *= 2;
+            }
+        }
+        auto actualSize = (size_t)getActualSpectrumSize(m_fftWindowSize);
+        if (m_spectrumBins == 0)
+            m_spectrumBins = actualSize;
+
+        // band edges in fmod bins
+        std::vector<float> edges(m_spectrumBins + 1);
+        if (m_spectrumScale == SpectrumScale::Linear) {
+            for (size_t i = 0; i <= m_spectrumBins; ++i)
+                edges[i] = (float)i * (float)actualSize / (float)m_spectrumBins;
+        }
+        else {
+            auto binWidth = sampleRate / (float)m_fftWindowSize;
+            auto minFrequency = std::max(20.f, binWidth);
+            auto maxFrequency = (float)actualSize * binWidth;
+            const auto toScale = [&](float frequency) {
+                if (m_spectrumScale == SpectrumScale::Mel)
+                    return 2595.f * std::log10(1.f + frequency / 700.f);
+                return std::log(frequency);
+            };
+            const auto fromScale = [&](float value) {
+                if (m_spectrumScale == SpectrumScale::Mel)
+                    return 700.f * (std::pow(10.f, value / 2595.f) - 1.f);
+                return std::exp(value);
+            };
+            auto minValue = toScale(minFrequency);
+            auto maxValue = toScale(maxFrequency);
+            for (size_t i = 0; i <= m_spectrumBins; ++i) {
+                auto value = minValue + (maxValue - minValue) * (float)i / (float)m_spectrumBins;
+                edges[i] = fromScale(value) / binWidth;
+            }
+        }
+
+        // bands narrower than a single fmod bin just use the one they're in
+        m_spectrumBands.resize(m_spectrumBins);
+        for (size_t i = 0; i < m_spectrumBins; ++i) {
+            auto start = std::min((size_t)edges[i], actualSize - 1);
+            auto end = std::clamp((size_t)std::ceil(edges[i + 1]), start + 1, actualSize);
+            m_spectrumBands[i] = { start, end };
+        }
+
+        m_rawSpectrum.assign(actualSize, 0.f);
+        m_spectrum.assign(m_spectrumBins, 0.f);
+        m_oldSpectrum.assign(m_spectrumBins, 0.f);
+        m_newSpectrum.assign(m_spectrumBins, 0.f);
+    }
+
+    void reduceSpectrum() {
+        for (size_t i = 0; i < m_spectrumBands.size(); ++i) {
+            auto [start, end] = m_spectrumBands[i];
+            // separate lanes so the compiler can vectorize this without fast math
+            float lanes[4] { };
+            auto j = start;
+            for (; j + 4 <= end; j += 4) {
+                lanes[0] += m_rawSpectrum[j + 0];
+                lanes[1] += m_rawSpectrum[j + 1];
+                lanes[2] += m_rawSpectrum[j + 2];
+                lanes[3] += m_rawSpectrum[j + 3];
+            }
+            float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+            for (; j < end; ++j)
+                sum += m_rawSpectrum[j];
+            auto value = sum / (float)(end - start);
+            m_newSpectrum[i] = m_spectrumSmoothing * m_oldSpectrum[i] + (1.f - m_spectrumSmoothing) * value;
+        }
+    }
+
+    static void blendSpectrum(float* spectrum, const float* oldSpectrum, const float* newSpectrum, size_t size, float t) {
+        for (size_t i = 0; i < size; i++) {
+            spectrum[i] = (1.f - t) * oldSpectrum[i] + t * newSpectrum[i];
         }
     }
 
@@ -404,66 +1179,548 @@ public:
             parVis && node->isVisible()
         );
     }
-    void draw() override {
-        glBindVertexArray(m_vao);
-
+    bool initLoopPlayback() {
+        if (!s_loopPlaybackShader.program) {
+            auto res = s_loopPlaybackShader.compile(
+                "attribute vec4 aPosition;\n"
+                "void main() { gl_Position = aPosition; }",
+                "uniform sampler2D frame0;\n"
+                "uniform sampler2D frame1;\n"
+                "uniform vec2 resolution;\n"
+                "uniform vec2 uvScale;\n"
+                "uniform float blend;\n"
+                "void main() {\n"
+                "    vec2 uv = gl_FragCoord.xy / resolution * uvScale;\n"
+                "    gl_FragColor = mix(texture2D(frame0, uv), texture2D(frame1, uv), blend);\n"
+                "}"
+            );
+            if (res) {
+                glBindAttribLocation(s_loopPlaybackShader.program, 0, "aPosition");
+                res = s_loopPlaybackShader.link();
+            }
+            if (!res) {
+                log::error("failed to create loop playback shader: {}", res.unwrapErr());
+                s_loopPlaybackShader.cleanup();
+                return false;
+            }
+        }
+        auto program = s_loopPlaybackShader.program;
+        ccGLUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "frame0"), 0);
+        glUniform1i(glGetUniformLocation(program, "frame1"), 1);
+        m_uniformLoopResolution = glGetUniformLocation(program, "resolution");
+        m_uniformLoopUvScale = glGetUniformLocation(program, "uvScale");
+        m_uniformLoopBlend = glGetUniformLocation(program, "blend");
         ccGLUseProgram(m_shader.program);
+        return true;
+    }
+
+    static CCSize getFrameSize() {
+        return CCDirector::sharedDirector()->getOpenGLView()->getFrameSize() * geode::utils::getDisplayFactor();
+    }
+
+    // render textures have to be gone before cocos shuts down, so this can't wait for static destruction
+    static void clearBakedLoops() {
+        s_bakedLoops.clear();
+    }
+
+    void bakeLoop() {
+        auto frSize = getFrameSize();
+        auto bakeWidth = std::max(std::round(frSize.width * m_loopScale), 1.f);
+        auto bakeHeight = std::max(std::round(frSize.height * m_loopScale), 1.f);
+
+        if (!m_bakedLoop || m_bakedLoop->width != bakeWidth || m_bakedLoop->height != bakeHeight) {
+            auto& loop = s_bakedLoops[m_menuName];
+            if (!loop || loop->fragmentHash != m_fragmentHash || loop->width != bakeWidth || loop->height != bakeHeight ||
+                loop->frameCount != m_loopFrames || loop->period != m_loopPeriod) {
+                loop = std::make_shared<BakedLoop>(BakedLoop {
+                    .fragmentHash = m_fragmentHash,
+                    .width = bakeWidth,
+                    .height = bakeHeight,
+                    .frameCount = m_loopFrames,
+                    .period = m_loopPeriod
+                });
+            }
+            m_bakedLoop = loop;
+        }
+        if (m_bakedLoop->baked >= m_loopFrames)
+            return;
+
+        // CCRenderTexture expects points, not pixels
+        auto scaleFactor = CC_CONTENT_SCALE_FACTOR();
+        for (size_t i = 0; i < LOOP_BAKE_FRAMES_PER_DRAW && m_bakedLoop->baked < m_loopFrames; ++i) {
+            auto index = m_bakedLoop->baked;
+            Ref<CCRenderTexture> target = CCRenderTexture::create(
+                (int)(bakeWidth / scaleFactor), (int)(bakeHeight / scaleFactor),
+                kCCTexture2DPixelFormat_RGBA8888
+            );
+            if (!target) {
+                log::error("failed to create render texture for baking loop frame {}", index);
+                m_loopPeriod = 0.f;
+                return;
+            }
+            target->getSprite()->getTexture()->setAntiAliasTexParameters();
+            auto frameDelta = m_loopPeriod / (float)m_loopFrames;
+            target->beginWithClear(0.f, 0.f, 0.f, 0.f);
+            drawShader(getLiveInputs(target->getSprite()->getTexture()->getContentSizeInPixels(),
+                frameDelta * (float)index, frameDelta, (GLint)index));
+            target->end();
+            m_bakedLoop->frames.push_back(target);
+            m_bakedLoop->baked++;
+        }
+
+        if (m_bakedLoop->baked >= m_loopFrames)
+            log::debug("baked {} loop frames at {}x{}", m_loopFrames, bakeWidth, bakeHeight);
+    }
+
+    void drawLoop(bool occluded) {
+        auto& frames = m_bakedLoop->frames;
+        auto phase = std::fmod(m_time, m_loopPeriod) / m_loopPeriod * (float)frames.size();
+        auto first = std::min((size_t)phase, frames.size() - 1);
+        auto second = (first + 1) % frames.size();
+        auto firstTexture = frames[first]->getSprite()->getTexture();
+        auto secondTexture = frames[second]->getSprite()->getTexture();
+
+        ccGLUseProgram(s_loopPlaybackShader.program);
+
+        auto frSize = getFrameSize();
+        auto contentSize = firstTexture->getContentSizeInPixels();
+        glUniform2f(m_uniformLoopResolution, frSize.width, frSize.height);
+        glUniform2f(m_uniformLoopUvScale,
+            contentSize.width / (float)firstTexture->getPixelsWide(),
+            contentSize.height / (float)firstTexture->getPixelsHigh());
+        glUniform1f(m_uniformLoopBlend, phase - std::floor(phase));
+        ccGLBindTexture2DN(0, firstTexture->getName());
+        ccGLBindTexture2DN(1, secondTexture->getName());
+
+        drawQuad(occluded);
+    }
+
+    void drawQuad(bool occluded) {
+        if (occluded && !m_occluderRects.empty()) {
+            if (m_occludedVertexCount == 0)
+                return;
+            glBindVertexArray(m_occludedVao);
+            glDrawArrays(GL_TRIANGLES, 0, m_occludedVertexCount);
+        }
+        else {
+            glBindVertexArray(m_vao);
+            glDrawArrays(GL_TRIANGLES, 0, 6);
+        }
 
-        auto glv = CCDirector::sharedDirector()->getOpenGLView();
+        glBindVertexArray(0);
+
+#if !defined(GEODE_IS_MACOS) && !defined(GEODE_IS_IOS)
+        CC_INCREMENT_GL_DRAWS(1);
+#endif
+    }
+
+    void setOccluders(const std::vector<std::string>& ids) {
+        for (auto& id : ids)
+            m_occluders.emplace_back(id, static_cast<CCNode*>(nullptr));
+        glGenVertexArrays(1, &m_occludedVao);
+        glGenBuffers(1, &m_occludedVbo);
+        glBindVertexArray(m_occludedVao);
+        glBindBuffer(GL_ARRAY_BUFFER, m_occludedVbo);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), (void*)nullptr);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    void updateOccluders() {
         auto winSize = CCDirector::sharedDirector()->getWinSize();
-        auto frSize = glv->getFrameSize() * geode::utils::getDisplayFactor();
 
-        glUniform2f(m_uniformResolution, frSize.width, frSize.height);
-        glUniform3f(m_uniformResolutionShadertoy, frSize.width, frSize.height, 0.f);
-        auto mousePos = cocos::getMousePos() / winSize * frSize;
-        glUniform2f(m_uniformMouse, mousePos.x, mousePos.y);
-        glUniform4f(m_uniformMouseShadertoy, mousePos.x, mousePos.y, 0.f, 0.f);
+        // min x, min y, max x, max y in clip space
+        std::vector<std::array<float, 4>> rects;
+        for (auto& [id, weakNode] : m_occluders) {
+            Ref<CCNode> ref = weakNode.lock();
+            if (!ref || !ref->getParent()) {
+                ref = this->getParent()->getChildByIDRecursive(id);
+                weakNode = ref.data();
+            }
+            CCNode* node = ref.data();
+            if (node == nullptr)
+                continue;
+            auto [rotation, scaleX, scaleY, visible] = getStuffRecursive(node);
+            if (!visible || std::fmod(rotation, 90.f) != 0.f)
+                continue;
+            if (auto rgba = typeinfo_cast<CCRGBAProtocol*>(node); rgba && rgba->getDisplayedOpacity() < 255)
+                continue;
+            auto rect = CCRectApplyAffineTransform(CCRect(0.f, 0.f, node->getContentSize().width, node->getContentSize().height), node->nodeToWorldTransform());
+            std::array<float, 4> clip {
+                std::max((rect.getMinX() + OCCLUDER_INSET) / winSize.width * 2.f - 1.f, -1.f),
+                std::max((rect.getMinY() + OCCLUDER_INSET) / winSize.height * 2.f - 1.f, -1.f),
+                std::min((rect.getMaxX() - OCCLUDER_INSET) / winSize.width * 2.f - 1.f, 1.f),
+                std::min((rect.getMaxY() - OCCLUDER_INSET) / winSize.height * 2.f - 1.f, 1.f)
+            };
+            if (clip[0] >= clip[2] || clip[1] >= clip[3])
+                continue;
+            rects.push_back(clip);
+        }
 
-        for (size_t i = 0; i < m_shaderSprites.size(); ++i) {
-            auto sprite = m_shaderSprites[i];
-            ccGLBindTexture2DN(i, sprite->getTexture()->getName());
+        if (rects == m_occluderRects)
+            return;
+        m_occluderRects = std::move(rects);
+        if (m_occluderRects.empty())
+            return;
+
+        // split the screen into a grid along the edges of the occluders
+        // and emit the cells that aren't covered, merging neighbouring ones in each row
+        std::vector<float> xs { -1.f, 1.f };
+        std::vector<float> ys { -1.f, 1.f };
+        for (auto& rect : m_occluderRects) {
+            xs.push_back(rect[0]);
+            xs.push_back(rect[2]);
+            ys.push_back(rect[1]);
+            ys.push_back(rect[3]);
         }
+        std::sort(xs.begin(), xs.end());
+        xs.erase(std::unique(xs.begin(), xs.end()), xs.end());
+        std::sort(ys.begin(), ys.end());
+        ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+
+        const auto isCovered = [&](float x, float y) {
+            return std::any_of(m_occluderRects.begin(), m_occluderRects.end(), [&](const auto& rect) {
+                return x > rect[0] && x < rect[2] && y > rect[1] && y < rect[3];
+            });
+        };
 
-        glUniform1f(m_uniformTime, m_time);
-        glUniform1f(m_uniformDeltaTime, m_deltaTime);
-        glUniform1f(m_uniformFrameRate, 1.f / m_deltaTime);
-        glUniform1i(m_uniformFrame, m_frame);
+        std::vector<GLfloat> vertices;
+        for (size_t j = 0; j + 1 < ys.size(); ++j) {
+            auto bottom = ys[j];
+            auto top = ys[j + 1];
+            auto y = (bottom + top) * 0.5f;
+            std::optional<float> left;
+            for (size_t i = 0; i + 1 < xs.size(); ++i) {
+                bool covered = isCovered((xs[i] + xs[i + 1]) * 0.5f, y);
+                if (!covered && !left)
+                    left = xs[i];
+                auto last = i + 2 == xs.size();
+                if (left && (covered || last)) {
+                    auto right = covered ? xs[i] : xs[i + 1];
+                    vertices.insert(vertices.end(), {
+                        *left, top,
+                        *left, bottom,
+                        right, bottom,
+
+                        *left, top,
+                        right, bottom,
+                        right, top
+                    });
+                    left.reset();
+                }
+            }
+        }
 
-        // thx adaf for telling me where these are
-        auto engine = FMODAudioEngine::sharedEngine();
-        if (!engine->m_metering)
-            engine->enableMetering();
-        glUniform1f(m_uniformPulse1, engine->m_pulse1);
-        glUniform1f(m_uniformPulse2, engine->m_pulse2);
-        glUniform1f(m_uniformPulse3, engine->m_pulse3);
+        m_occludedVertexCount = (GLsizei)(vertices.size() / 2);
+        glBindBuffer(GL_ARRAY_BUFFER, m_occludedVbo);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    static void getNodeData(CCNode* node, float* data) {
+        auto pos = node->convertToWorldSpace(node->getAnchorPointInPoints());
+        auto [rotation, scaleX, scaleY, visible] = getStuffRecursive(node);
+        data[0] = pos.x;
+        data[1] = pos.y;
+        data[2] = node->getContentSize().width;
+        data[3] = node->getContentSize().height;
+        data[4] = rotation;
+        data[5] = scaleX;
+        data[6] = scaleY;
+        data[7] = visible ? 1.f : 0.f;
+    }
 
-        glUniform1fv(m_uniformFft, FFT_ACTUAL_SPECTRUM_SIZE, m_spectrum);
+    // same search order as getChildByIDRecursive, so the same node is picked when ids repeat
+    static void findNodesByID(CCNode* parent, std::unordered_map<std::string, CCNode*>& nodes, size_t& remaining) {
+        if (!parent->getChildren())
+            return;
+        auto children = CCArrayExt<CCNode*>(parent->getChildren());
+        for (auto child : children) {
+            auto it = nodes.find(child->getID());
+            if (it != nodes.end() && it->second == nullptr) {
+                it->second = child;
+                if (--remaining == 0)
+                    return;
+            }
+        }
+        for (auto child : children) {
+            findNodesByID(child, nodes, remaining);
+            if (remaining == 0)
+                return;
+        }
+    }
 
+    void updateNodes() {
+        auto data = m_nodeData.data();
         for (auto& [id, node, posLoc, rotLoc, scaleLoc, sizeLoc, visibleLoc] : m_uniformNodes) {
             if (node == nullptr)
                 node = this->getParent()->getChildByIDRecursive(id);
             if (node == nullptr) {
                 log::warn("failed to find node with id '{}'", id);
-                continue;
+                std::fill_n(data, NODE_DATA_SIZE, 0.f);
             }
-            auto pos = node->convertToWorldSpace(node->getAnchorPointInPoints());
-            glUniform2f(posLoc, pos.x, pos.y);
-            glUniform2f(sizeLoc, node->getContentSize().width, node->getContentSize().height);
-            if (!rotLoc && !scaleLoc && !visibleLoc)
-                continue;
-            auto [rotation, scaleX, scaleY, visible] = getStuffRecursive(node);
-            glUniform1f(rotLoc, rotation);
-            glUniform2f(scaleLoc, scaleX, scaleY);
-            glUniform1i(visibleLoc, visible);
+            else {
+                getNodeData(node, data);
+            }
+            data += NODE_DATA_SIZE;
         }
 
-        glDrawArrays(GL_TRIANGLES, 0, 6);
+        // look all the missing nodes up in a single walk instead of one getChildByIDRecursive each,
+        // since there can be a lot of them that just don't exist on the current page
+        std::unordered_map<std::string, CCNode*> missing;
+        for (auto& packed : m_packedNodes) {
+            Ref<CCNode> ref = packed.node.lock();
+            if (!ref || !ref->getParent())
+                missing.emplace(packed.id, nullptr);
+        }
+        if (!missing.empty()) {
+            auto remaining = missing.size();
+            findNodesByID(this->getParent(), missing, remaining);
+        }
 
-        glBindVertexArray(0);
+        for (auto& [id, weakNode, warned] : m_packedNodes) {
+            Ref<CCNode> ref = weakNode.lock();
+            if (!ref || !ref->getParent()) {
+                ref = missing[id];
+                weakNode = ref.data();
+            }
+            CCNode* node = ref.data();
+            if (node == nullptr && !warned)
+                log::warn("failed to find node with id '{}'", id);
+            warned = node == nullptr;
+            if (node == nullptr)
+                std::fill_n(data, NODE_DATA_SIZE, 0.f);
+            else
+                getNodeData(node, data);
+            data += NODE_DATA_SIZE;
+        }
+    }
 
-#if !defined(GEODE_IS_MACOS) && !defined(GEODE_IS_IOS)
-        CC_INCREMENT_GL_DRAWS(1);
-#endif
+    FrameInputs getLiveInputs(const CCSize& frSize, float time, float deltaTime, GLint frame) {
+        updateNodes();
+
+        auto winSize = CCDirector::sharedDirector()->getWinSize();
+
+        // thx adaf for telling me where these are
+        auto engine = FMODAudioEngine::sharedEngine();
+        if (!engine->m_metering)
+            engine->enableMetering();
+
+        return {
+            .resolution = frSize,
+            .time = time,
+            .deltaTime = deltaTime,
+            .frame = frame,
+            .mouse = cocos::getMousePos() / winSize * frSize,
+            .pulse1 = engine->m_pulse1,
+            .pulse2 = engine->m_pulse2,
+            .pulse3 = engine->m_pulse3,
+            .spectrumBlend = m_spectrumBlend,
+            .spectrum = m_spectrum.data(),
+            .nodes = m_nodeData.data()
+        };
+    }
+
+    void draw() override {
+        updateLookupTables();
+        // same as baking, replaying with the placeholders would time the wrong thing
+        if (!m_replayPath.empty() && lookupTablesReady())
+            replayTrace(std::exchange(m_replayPath, {}));
+
+        bool occluded = !m_occluders.empty();
+        if (occluded)
+            updateOccluders();
+
+        bool playLoop = false;
+        // don't bake the placeholders into the loop
+        if (m_loopPeriod > 0.f && lookupTablesReady()) {
+            bakeLoop();
+            playLoop = m_loopPeriod > 0.f && m_bakedLoop->baked >= m_loopFrames;
+        }
+
+        // keep capturing during loop playback too, so the trace still has the inputs to replay the real shader with
+        if (playLoop && !m_traceWriter) {
+            drawLoop(occluded);
+            return;
+        }
+
+        auto inputs = getLiveInputs(getFrameSize(), m_time, m_deltaTime, m_frame);
+        if (m_traceWriter)
+            captureFrame(inputs);
+        if (playLoop)
+            drawLoop(occluded);
+        else
+            drawShader(inputs, occluded);
+    }
+
+    void drawShader(const FrameInputs& inputs, bool occluded = false) {
+        ccGLUseProgram(m_shader.program);
+
+        auto& frSize = inputs.resolution;
+        glUniform2f(m_uniformResolution, frSize.width, frSize.height);
+        glUniform3f(m_uniformResolutionShadertoy, frSize.width, frSize.height, 0.f);
+        glUniform2f(m_uniformMouse, inputs.mouse.x, inputs.mouse.y);
+        glUniform4f(m_uniformMouseShadertoy, inputs.mouse.x, inputs.mouse.y, 0.f, 0.f);
+
+        for (size_t i = 0; i < m_shaderSprites.size(); ++i) {
+            auto sprite = m_shaderSprites[i];
+            ccGLBindTexture2DN(i, sprite->getTexture()->getName());
+        }
+        for (size_t i = 0; i < m_lookupTextures.size(); ++i) {
+            ccGLBindTexture2DN(m_shaderSprites.size() + i, m_lookupTextures[i]->getName());
+        }
+
+        glUniform1f(m_uniformTime, inputs.time);
+        glUniform1f(m_uniformDeltaTime, inputs.deltaTime);
+        glUniform1f(m_uniformFrameRate, 1.f / inputs.deltaTime);
+        glUniform1i(m_uniformFrame, inputs.frame);
+
+        glUniform1f(m_uniformPulse1, inputs.pulse1);
+        glUniform1f(m_uniformPulse2, inputs.pulse2);
+        glUniform1f(m_uniformPulse3, inputs.pulse3);
+
+        glUniform1fv(m_uniformFft, (GLsizei)m_spectrum.size(), inputs.spectrum);
+
+        auto data = inputs.nodes;
+        for (auto& [id, node, posLoc, rotLoc, scaleLoc, sizeLoc, visibleLoc] : m_uniformNodes) {
+            glUniform2f(posLoc, data[0], data[1]);
+            glUniform2f(sizeLoc, data[2], data[3]);
+            glUniform1f(rotLoc, data[4]);
+            glUniform2f(scaleLoc, data[5], data[6]);
+            glUniform1i(visibleLoc, data[7] != 0.f);
+            data += NODE_DATA_SIZE;
+        }
+
+        if (!m_packedNodes.empty())
+            glUniform4fv(m_uniformPackedNodes, (GLsizei)(m_packedNodes.size() * NODE_DATA_SIZE / 4), data);
+        glUniform1i(m_uniformNodeCount, (GLint)m_packedNodes.size());
+
+        drawQuad(occluded);
+    }
+
+    void startCapture(const std::string& name) {
+        auto dir = Mod::get()->getSaveDir() / "traces";
+        std::error_code err;
+        std::filesystem::create_directories(dir, err);
+        auto path = dir / fmt::format("{}-{}.trace", name, std::chrono::system_clock::now().time_since_epoch().count());
+
+        m_traceValues.resize(TRACE_FIXED_VALUES + m_nodeData.size());
+        auto writer = std::make_unique<TraceWriter>();
+        auto res = writer->open(path, name, m_fragmentHash, m_traceValues.size(), m_spectrum.size());
+        if (!res) {
+            log::error("failed to start capturing trace: {}", res.unwrapErr());
+            return;
+        }
+        log::info("capturing shader inputs to {}", path.string());
+        m_traceWriter = std::move(writer);
+    }
+
+    void captureFrame(const FrameInputs& inputs) {
+        auto values = m_traceValues.data();
+        values[0] = inputs.resolution.width;
+        values[1] = inputs.resolution.height;
+        values[2] = inputs.time;
+        values[3] = inputs.deltaTime;
+        values[4] = std::bit_cast<float>(inputs.frame);
+        values[5] = inputs.mouse.x;
+        values[6] = inputs.mouse.y;
+        values[7] = inputs.pulse1;
+        values[8] = inputs.pulse2;
+        values[9] = inputs.pulse3;
+        values[10] = inputs.spectrumBlend;
+        std::copy_n(inputs.nodes, m_nodeData.size(), values + TRACE_FIXED_VALUES);
+
+        if (m_spectrumUpdated)
+            m_traceWriter->writeFrame(values, m_oldSpectrum.data(), m_newSpectrum.data());
+        else
+            m_traceWriter->writeFrame(values, nullptr, nullptr);
+        m_spectrumUpdated = false;
+    }
+
+    // renders every frame of a trace offscreen and logs how long they took
+    void replayTrace(const std::filesystem::path& path) {
+        TraceReader trace;
+        auto res = trace.open(path);
+        if (!res) {
+            log::error("failed to replay trace: {}", res.unwrapErr());
+            Mod::get()->setSettingValue<std::filesystem::path>("replay-trace", {});
+            return;
+        }
+        // only replay in the menu the trace was captured in, and only once,
+        // since it freezes the game until it's done
+        if (trace.menuName() != m_menuName)
+            return;
+        Mod::get()->setSettingValue<std::filesystem::path>("replay-trace", {});
+        if (trace.shaderHash() != m_fragmentHash)
+            log::warn("trace {} was captured with a different shader", path.string());
+        if (trace.spectrumSize() != m_spectrum.size() ||
+            trace.values().size() != TRACE_FIXED_VALUES + m_nodeData.size()) {
+            log::error("trace {} doesn't match the inputs of this shader", path.string());
+            return;
+        }
+
+        std::vector<float> spectrum(trace.spectrumSize());
+        std::vector<double> frameTimes;
+        Ref<CCRenderTexture> target;
+        CCSize targetSize;
+        while (trace.nextFrame()) {
+            auto& values = trace.values();
+            FrameInputs inputs {
+                .resolution = CCSize(values[0], values[1]),
+                .time = values[2],
+                .deltaTime = values[3],
+                .frame = std::bit_cast<GLint>(values[4]),
+                .mouse = CCPoint(values[5], values[6]),
+                .pulse1 = values[7],
+                .pulse2 = values[8],
+                .pulse3 = values[9],
+                .spectrumBlend = values[10],
+                .spectrum = spectrum.data(),
+                .nodes = values.data() + TRACE_FIXED_VALUES
+            };
+            blendSpectrum(spectrum.data(), trace.oldSpectrum().data(), trace.newSpectrum().data(),
+                spectrum.size(), inputs.spectrumBlend);
+
+            if (!target) {
+                // CCRenderTexture expects points, not pixels
+                auto scaleFactor = CC_CONTENT_SCALE_FACTOR();
+                targetSize = inputs.resolution;
+                target = CCRenderTexture::create(
+                    (int)(targetSize.width / scaleFactor), (int)(targetSize.height / scaleFactor),
+                    kCCTexture2DPixelFormat_RGBA8888
+                );
+                if (!target) {
+                    log::error("failed to create render texture for replaying trace");
+                    return;
+                }
+            }
+
+            target->begin();
+            glFinish();
+            auto start = std::chrono::steady_clock::now();
+            drawShader(inputs);
+            glFinish();
+            auto end = std::chrono::steady_clock::now();
+            target->end();
+            frameTimes.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+        }
+        if (!trace.atEnd())
+            log::warn("trace {} is truncated", path.string());
+        if (frameTimes.empty()) {
+            log::warn("trace {} has no frames", path.string());
+            return;
+        }
+
+        auto total = std::accumulate(frameTimes.begin(), frameTimes.end(), 0.0);
+        std::sort(frameTimes.begin(), frameTimes.end());
+        log::info(
+            "replayed {} frames of {} at {}x{}: avg {:.3f}ms, min {:.3f}ms, median {:.3f}ms, 95% {:.3f}ms, max {:.3f}ms",
+            frameTimes.size(), path.filename().string(), targetSize.width, targetSize.height,
+            total / (double)frameTimes.size(), frameTimes.front(), frameTimes[frameTimes.size() / 2],
+            frameTimes[frameTimes.size() * 95 / 100], frameTimes.back()
+        );
     }
 
     static ShaderNode* create(const std::string& vert, const std::string& frag) {
@@ -540,10 +1797,15 @@ public:
         auto shader = ShaderNode::create(vertexSource.unwrap(), fragmentSource);
         if (!shader)
             return Err("failed to create shader node");
+        shader->m_menuName = name;
+
+        if (Mod::get()->getSettingValue<bool>("capture-trace"))
+            shader->startCapture(name);
+        shader->m_replayPath = Mod::get()->getSettingValue<std::filesystem::path>("replay-trace");
         return Ok(shader);
     }
 
-    static bool tryAddToNode(CCNode* node, const std::string& name, int zOrder) {
+    static bool tryAddToNode(CCNode* node, const std::string& name, int zOrder, const std::vector<std::string>& occluders) {
         if (!Mod::get()->getSettingValue<bool>("show-" + name)) {
             s_shaderTime = 0.f;
             s_shaderFrame = 0;
@@ -558,12 +1820,14 @@ public:
             return false;
         }
         auto shader = res.unwrap();
+        if (!occluders.empty() && Mod::get()->getSettingValue<bool>("occlusion-culling"))
+            shader->setOccluders(occluders);
         shader->setZOrder(zOrder);
         node->addChild(shader);
         return true;
     }
 
-    static bool tryReplaceBackgroundInLayer(CCLayer* layer, const std::string& name) {
+    static bool tryReplaceBackgroundInLayer(CCLayer* layer, const std::string& name, const std::vector<std::string>& occluders = {}) {
         auto bg = layer->getChildByID("background");
         int zOrder = -10;
         if (!bg)
@@ -572,7 +1836,7 @@ public:
             zOrder = bg->getZOrder();
         if (!bg)
             return false;
-        if (!tryAddToNode(layer, name, zOrder))
+        if (!tryAddToNode(layer, name, zOrder, occluders))
             return false;
         bg->setVisible(false);
         return true;
@@ -637,7 +1901,7 @@ class $modify(LevelBrowserLayer) {
     bool init(GJSearchObject* search) {
         if (!LevelBrowserLayer::init(search))
             return false;
-        if (!ShaderNode::tryReplaceBackgroundInLayer(this, "level-browser"))
+        if (!ShaderNode::tryReplaceBackgroundInLayer(this, "level-browser", { "GJListLayer" }))
             return true;
         if (Mod::get()->getSettingValue<bool>("level-browser-hide-corners")) {
             tryHideChild(this, "left-corner");
@@ -686,7 +1950,13 @@ class $modify(LevelSearchLayer) {
     bool init(int a) {
         if (!LevelSearchLayer::init(a))
             return false;
-        if (!ShaderNode::tryReplaceBackgroundInLayer(this, "search"))
+        if (!ShaderNode::tryReplaceBackgroundInLayer(this, "search", {
+            "level-search-bg",
+            "level-search-bar-bg",
+            "quick-search-bg",
+            "difficulty-filters-bg",
+            "length-filters-bg"
+        }))
             return true;
         if (Mod::get()->getSettingValue<bool>("search-hide-corners")) {
             tryHideChild(this, "left-corner");
@@ -708,7 +1978,7 @@ class $modify(GJGarageLayer) {
     bool init() {
         if (!GJGarageLayer::init())
             return false;
-        if (!ShaderNode::tryReplaceBackgroundInLayer(this, "garage"))
+        if (!ShaderNode::tryReplaceBackgroundInLayer(this, "garage", { "select-background" }))
             return true;
         if (Mod::get()->getSettingValue<bool>("garage-hide-corners")) {
             tryHideChild(this, "top-left-corner");
@@ -781,3 +2051,12 @@ class $modify(SecretRewardsLayer) {
         return true;
     }
 };
+
+#include <Geode/modify/CCDirector.hpp>
+class $modify(CCDirector) {
+    // only called when the game actually exits, unlike trySaveGame which mobile also calls when going to the background
+    void purgeDirector() {
+        ShaderNode::clearBakedLoops();
+        CCDirector::purgeDirector();
+    }
+};